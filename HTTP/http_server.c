@@ -7,9 +7,19 @@
 #include <signal.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <sys/sendfile.h>
+#include <poll.h>
+#include <stdint.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+// kTLS(SSL_OP_ENABLE_KTLS, BIO_get_ktls_send) 和 SSL_sendfile 都是 OpenSSL 3.0 才有的
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+#error "http_server requires OpenSSL 3.0 or later"
+#endif
 
 typedef struct sockaddr sockaddr;
 typedef struct sockaddr_in sockaddr_in;
@@ -25,10 +35,311 @@ typedef struct HttpRequest
   char *url_path;
   char *query_string;
   int content_length;
+  int upgrade_h2c;            // 请求头中带了 Upgrade: h2c
+  char http2_settings[256];   // 升级时 HTTP2-Settings 头的值
 }HttpRequest;
 
+// 将一个客户端连接封装成结构体。明文连接时 ssl 为 NULL,
+// 所有的读写都要经过下面的 Conn 系列函数，而不是直接操作 sock.
+typedef struct H2Stream H2Stream;
+typedef struct HttpConn
+{
+  int sock;
+  SSL *ssl;
+  int ktls_send; // 握手完成后，发送方向是否已经交给内核 kTLS 来加密
+  // HTTP/2 时读线程和各个流的处理线程共用同一个 SSL 对象，
+  // 而 SSL 对象不是线程安全的，此时每次调用 SSL 函数都要加这把锁。
+  pthread_mutex_t *ssl_lock;
+  // 不为 NULL 时表示这是 HTTP/2 连接上的一个流，
+  // 读写的是这个流的请求 body 和响应，而不是 socket.
+  H2Stream *stream;
+}HttpConn;
+
+ssize_t H2StreamRecv(H2Stream* stream, void* buf, size_t len, int flags);
+ssize_t H2StreamSend(H2Stream* stream, const void* buf, size_t len);
+ssize_t H2StreamSendFile(H2Stream* stream, int fd, size_t size);
+int H2StreamSendHead(H2Stream* stream, int status, ssize_t content_length);
+
+// 全局的 TLS 上下文，为 NULL 表示服务器只提供明文 HTTP.
+// SSL_CTX 本身是线程安全的，所有连接线程共享同一个。
+SSL_CTX *g_ssl_ctx = NULL;
+
+// ALPN 协商：客户端支持 h2 就优先使用 HTTP/2, 否则退回 http/1.1
+int TlsAlpnSelect(SSL* ssl, const unsigned char** out, unsigned char* outlen,
+    const unsigned char* in, unsigned int inlen, void* arg)
+{
+  (void)ssl;
+  (void)arg;
+  static const unsigned char protos[] = "\x02h2\x08http/1.1";
+  if(SSL_select_next_proto((unsigned char**)out, outlen, protos, sizeof(protos)-1,
+        in, inlen) != OPENSSL_NPN_NEGOTIATED)
+  {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+// 初始化 TLS 上下文
+// 测试用的自签名证书可以这样生成：
+// openssl req -x509 -newkey rsa:2048 -nodes -days 365 -subj "/CN=localhost"
+//   -keyout key.pem -out cert.pem
+SSL_CTX *TlsInit(const char* cert_file, const char* key_file)
+{
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if(ctx == NULL)
+  {
+    ERR_print_errors_fp(stderr);
+    return NULL;
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  // 让 OpenSSL 在握手结束后把协商好的密钥通过 setsockopt(TCP_ULP, "tls")
+  // 交给内核，之后 sendfile 发出去的数据由内核直接加密，不用再拷贝到用户态。
+  // 如果内核没有加载 tls 模块，OpenSSL 会自动退回到用户态加密。
+  SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+  // 会话恢复：客户端重连时带上 session ticket 就可以跳过完整握手。
+  // ticket 的加密密钥由 OpenSSL 随 ctx 生成，进程存活期间一直有效。
+  SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_set_session_id_context(ctx, (const unsigned char*)"http_server",
+      strlen("http_server"));
+  SSL_CTX_set_num_tickets(ctx, 2);
+  SSL_CTX_set_timeout(ctx, 3600);
+  SSL_CTX_set_alpn_select_cb(ctx, TlsAlpnSelect, NULL);
+
+  if(SSL_CTX_use_certificate_chain_file(ctx, cert_file) <= 0
+      || SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) <= 0
+      || SSL_CTX_check_private_key(ctx) <= 0)
+  {
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+// 完成 TLS 握手，成功返回 0
+int TlsAccept(HttpConn* conn)
+{
+  conn->ssl = SSL_new(g_ssl_ctx);
+  if(conn->ssl == NULL)
+  {
+    ERR_print_errors_fp(stderr);
+    return -1;
+  }
+  SSL_set_fd(conn->ssl, conn->sock);
+  if(SSL_accept(conn->ssl) <= 0)
+  {
+    ERR_print_errors_fp(stderr);
+    // 握手发生了致命错误，不能再调用 SSL_shutdown, 直接释放掉，
+    // 后面的 ConnClose 就只会关闭 socket.
+    SSL_free(conn->ssl);
+    conn->ssl = NULL;
+    return -1;
+  }
+  // 判断发送方向的 kTLS 是否真正生效，决定后面 sendfile 走哪条路径。
+  conn->ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn->ssl));
+  return 0;
+}
+
+void ConnLock(HttpConn* conn)
+{
+  if(conn->ssl_lock != NULL)
+  {
+    pthread_mutex_lock(conn->ssl_lock);
+  }
+}
+
+void ConnUnlock(HttpConn* conn)
+{
+  if(conn->ssl_lock != NULL)
+  {
+    pthread_mutex_unlock(conn->ssl_lock);
+  }
+}
+
+// 共享 SSL 对象时 socket 是非阻塞的，SSL 调用返回 WANT_READ/WANT_WRITE 后，
+// 在不持有锁的情况下等待 socket 可读或可写，避免读线程等数据时卡住写线程。
+// 返回 0 表示可以重试。
+int ConnWait(HttpConn* conn, int ssl_err)
+{
+  if(conn->ssl_lock == NULL)
+  {
+    return -1;
+  }
+  struct pollfd pfd;
+  pfd.fd = conn->sock;
+  pfd.revents = 0;
+  if(ssl_err == SSL_ERROR_WANT_READ)
+  {
+    pfd.events = POLLIN;
+  }
+  else if(ssl_err == SSL_ERROR_WANT_WRITE)
+  {
+    pfd.events = POLLOUT;
+  }
+  else
+  {
+    return -1;
+  }
+  poll(&pfd, 1, -1);
+  return 0;
+}
+
+// 从连接中读数据，flags 只支持 0 和 MSG_PEEK
+ssize_t ConnRecv(HttpConn* conn, void* buf, size_t len, int flags)
+{
+  if(conn->stream != NULL)
+  {
+    return H2StreamRecv(conn->stream, buf, len, flags);
+  }
+  if(conn->ssl == NULL)
+  {
+    return recv(conn->sock, buf, len, flags);
+  }
+  while(1)
+  {
+    ConnLock(conn);
+    int ret = 0;
+    if(flags & MSG_PEEK)
+    {
+      ret = SSL_peek(conn->ssl, buf, len);
+    }
+    else
+    {
+      ret = SSL_read(conn->ssl, buf, len);
+    }
+    int err = ret > 0 ? SSL_ERROR_NONE : SSL_get_error(conn->ssl, ret);
+    ConnUnlock(conn);
+    if(ret > 0)
+    {
+      return ret;
+    }
+    if(ConnWait(conn, err) < 0)
+    {
+      return -1;
+    }
+  }
+}
+
+ssize_t ConnSend(HttpConn* conn, const void* buf, size_t len)
+{
+  if(conn->stream != NULL)
+  {
+    return H2StreamSend(conn->stream, buf, len);
+  }
+  if(conn->ssl == NULL)
+  {
+    return send(conn->sock, buf, len, 0);
+  }
+  while(1)
+  {
+    ConnLock(conn);
+    int ret = SSL_write(conn->ssl, buf, len);
+    int err = ret > 0 ? SSL_ERROR_NONE : SSL_get_error(conn->ssl, ret);
+    ConnUnlock(conn);
+    if(ret > 0)
+    {
+      return ret;
+    }
+    if(ConnWait(conn, err) < 0)
+    {
+      return -1;
+    }
+  }
+}
+
+// 把文件 fd 从当前读写位置开始的 size 个字节写到连接上
+ssize_t ConnSendFile(HttpConn* conn, int fd, size_t size)
+{
+  if(conn->stream != NULL)
+  {
+    return H2StreamSendFile(conn->stream, fd, size);
+  }
+  size_t total = 0;
+  if(conn->ssl == NULL)
+  {
+    // sendfile 一次不一定能写完，循环直到写够 size 个字节
+    while(total < size)
+    {
+      ssize_t ret = sendfile(conn->sock, fd, NULL, size - total);
+      if(ret <= 0)
+      {
+        return -1;
+      }
+      total += ret;
+    }
+    return total;
+  }
+  if(conn->ktls_send)
+  {
+    // kTLS 生效时，SSL_sendfile 内部就是 sendfile, 加密在内核完成，
+    // 依然是零拷贝。SSL_sendfile 需要显式给出偏移量，发送完再把文件的
+    // 读写位置往后移，和上面 sendfile 传 NULL 的效果保持一致。
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    while(total < size)
+    {
+      ConnLock(conn);
+      ossl_ssize_t ret = SSL_sendfile(conn->ssl, fd, offset + total, size - total, 0);
+      int err = ret > 0 ? SSL_ERROR_NONE : SSL_get_error(conn->ssl, (int)ret);
+      ConnUnlock(conn);
+      if(ret > 0)
+      {
+        total += ret;
+      }
+      else if(ConnWait(conn, err) < 0)
+      {
+        return -1;
+      }
+    }
+    lseek(fd, offset + total, SEEK_SET);
+    return total;
+  }
+  // 没有 kTLS 时只能读到用户态，再由 OpenSSL 加密后发送。
+  char buf[SIZE];
+  while(total < size)
+  {
+    ssize_t read_size = read(fd, buf, size - total < sizeof(buf) ? size - total : sizeof(buf));
+    if(read_size <= 0 || ConnSend(conn, buf, read_size) < 0)
+    {
+      return -1;
+    }
+    total += read_size;
+  }
+  return total;
+}
+
+// 发送响应的首行、header 和空行，content_length 小于 0 时不带 Content-Length.
+// HTTP/2 的流上会编码成一个 HEADERS 帧。
+int ConnSendHead(HttpConn* conn, int status, const char* reason, ssize_t content_length)
+{
+  if(conn->stream != NULL)
+  {
+    return H2StreamSendHead(conn->stream, status, content_length);
+  }
+  char head[SIZE]={0};
+  int len = sprintf(head, "HTTP/1.1 %d %s\n", status, reason);
+  if(content_length >= 0)
+  {
+    len += sprintf(head+len, "Content-Length: %ld\n", content_length);
+  }
+  len += sprintf(head+len, "\n");
+  return ConnSend(conn, head, len);
+}
+
+// 关闭连接，TLS 连接需要先发送 close_notify
+void ConnClose(HttpConn* conn)
+{
+  if(conn->ssl != NULL)
+  {
+    SSL_shutdown(conn->ssl);
+    SSL_free(conn->ssl);
+    conn->ssl = NULL;
+  }
+  close(conn->sock);
+}
+
 // 每次读一行
-int ReadLine(int sock, char buf[], ssize_t max_size) // ssize_t 为有符号的长整型，size_t 为无符号的长整型
+int ReadLine(HttpConn* conn, char buf[], ssize_t max_size) // ssize_t 为有符号的长整型，size_t 为无符号的长整型
 {
   // 按行从 socket 中读数据
   // 实际上浏览器发送的请求中换行符可能不一样。
@@ -38,7 +349,7 @@ int ReadLine(int sock, char buf[], ssize_t max_size) // ssize_t 为有符号的
   ssize_t i=0;  // 描述当前读到的字符应该放到缓冲区的那个下标上。
   while(i<max_size-1)
   {
-    ssize_t read_size=recv(sock, &c, 1, 0);
+    ssize_t read_size=ConnRecv(conn, &c, 1, 0);
     if(read_size <= 0)
     {
       // 此时认为读取数据失败，即使是recv返回0，也认为失败。
@@ -51,7 +362,7 @@ int ReadLine(int sock, char buf[], ssize_t max_size) // ssize_t 为有符号的
     { 
       // a) 尝试从缓冲区读取下一个字符，判定下一个字符是\n，
       //    就把这种情况处理成 \n
-      recv(sock, &c, 1, MSG_PEEK);
+      ConnRecv(conn, &c, 1, MSG_PEEK);
       // 选项 MSG_PEEK 表示：原本从内核的缓冲区中读数据时，
       // 规则和生产者-消费者模型类似，即读一个字符就将该字符
       // 从缓冲区中删除掉.但加上该选项后，读到的字符在该缓冲区
@@ -63,7 +374,7 @@ int ReadLine(int sock, char buf[], ssize_t max_size) // ssize_t 为有符号的
       {
         // 当前的行分隔符是 \r\n
         // 接下来就把下一个 \n 字符从缓冲区中删掉就可以了。
-        recv(sock, &c, 1, 0); 
+        ConnRecv(conn, &c, 1, 0); 
         // 第四个参数不加选项，默认为0时，表示读数据的同时，
         // 就从缓冲区中将该字符删掉了。
       }
@@ -165,13 +476,13 @@ int ParseQueryString(char url[], char **url_path_ptr, char **query_string_ptr)
   return 0;
 }
 
-// 处理 header，解析出content_length 
-int HandlerHeader(int new_sock, int *content_length_ptr)
+// 处理 header，解析出content_length 以及升级 HTTP/2 相关的字段
+int HandlerHeader(HttpConn* conn, HttpRequest* req)
 {
   char buf[SIZE]={0};
   while(1)
   {
-    if(ReadLine(new_sock, buf, sizeof(buf)) < 0 )
+    if(ReadLine(conn, buf, sizeof(buf)) < 0 )
     {
       printf("ReadLine failed!\n");
       return -1;
@@ -185,7 +496,7 @@ int HandlerHeader(int new_sock, int *content_length_ptr)
     const char* content_length_str = "Content-Length:";
     if(strncmp(buf, content_length_str, strlen(content_length_str))==0)
     {
-      *content_length_ptr=atoi(buf+strlen(content_length_str));
+      req->content_length=atoi(buf+strlen(content_length_str));
 
       // 此处代码不应该直接return ，本函数其实有两重含义：
       // 1. 找到 content_length 的值。
@@ -193,31 +504,43 @@ int HandlerHeader(int new_sock, int *content_length_ptr)
       //    避免粘包问题。
       // return 0;
     }
+    // Upgrade: h2c 表示客户端希望把这个明文连接升级成 HTTP/2
+    const char* upgrade_str = "Upgrade:";
+    if(strncasecmp(buf, upgrade_str, strlen(upgrade_str))==0
+        && strstr(buf+strlen(upgrade_str), "h2c") != NULL)
+    {
+      req->upgrade_h2c = 1;
+    }
+    // HTTP2-Settings: AAMAAABkAAQCAAAAAAIAAAAA
+    const char* settings_str = "HTTP2-Settings:";
+    if(strncasecmp(buf, settings_str, strlen(settings_str))==0)
+    {
+      const char* value = buf+strlen(settings_str);
+      value += strspn(value, " \t");
+      size_t len = strcspn(value, " \t\r\n");
+      // 值太长时不截断，当作没有这个头，也就不会升级
+      req->http2_settings[0] = '\0';
+      if(len < sizeof(req->http2_settings))
+      {
+        memcpy(req->http2_settings, value, len);
+        req->http2_settings[len] = '\0';
+      }
+    }
   } // end while(1)
 }
 
-int Handler404(int new_sock)
+int Handler404(HttpConn* conn)
 {
   // 构造一个错误处理的页面, 实际上是进行字符串的拼接。
   // 严格遵守 HTTP 响应格式
-  // 1. 首行
-  const char* first_line="HTTP/1.1 404 Not Found\n";
-  // 3. 空行
-  const char* blank_line="\n";
   // 4. body 
   // body 部分的内容就是 HTML
   const char* body="<head><meta http-equiv=\"content-type\" "
       "content=\"text/html;charset=utf-8\"></head>"
       "<h1>您的页面被喵星人吃掉了！！！</h1>";
-  // 2. header 
-  // 构造 content_length 部分
-  char content_length[SIZE]={0};
-  sprintf(content_length, "Content-Length: %lu\n",strlen(body));
-
-  send(new_sock, first_line, strlen(first_line), 0);
-  send(new_sock, content_length, strlen(content_length), 0);
-  send(new_sock, blank_line, strlen(blank_line), 0);
-  send(new_sock, body, strlen(body), 0);
+  // 1. 首行 2. header(content_length 部分) 3. 空行
+  ConnSendHead(conn, 404, "Not Found", strlen(body));
+  ConnSend(conn, body, strlen(body));
   return 0;
 }
 
@@ -262,19 +585,8 @@ void HandlerFilePath(const char* url_path, char file_path[])
   }
 }
 
-ssize_t GetFileSize(const char* file_path)
-{
-    struct stat st;
-    int ret = stat(file_path, &st);
-    if(ret < 0)
-    {
-        return 0;
-    }
-    return st.st_size;
-}
-
 // 
-int WriteStaticFile(int new_sock, const char* file_path)
+int WriteStaticFile(HttpConn* conn, const char* file_path)
 {
   // 1. 打开文件。如果打开失败，就返回 404。
   int fd=open(file_path, O_RDONLY);
@@ -284,13 +596,11 @@ int WriteStaticFile(int new_sock, const char* file_path)
       return 404;
   }
   // 2. 构造 http 响应报文。
-  const char* first_line = "HTTP/1.1 200 OK\n";
-  send(new_sock, first_line, strlen(first_line), 0);
   // 此处如果从一个更严谨的角度考虑，最好还要加上一些 header
   // 此处我们没有写 Content-Length 是因为后面立即关闭了 socket ,
-  // 浏览器就能识别出数据应该读到哪里结束。
-  const char* blank_line = "\n";
-  send(new_sock, blank_line, strlen(blank_line), 0);
+  // 浏览器就能识别出数据应该读到哪里结束。HTTP/2 则是靠流上的
+  // END_STREAM 标志来表示结束。
+  ConnSendHead(conn, 200, "OK", -1);
   // 3. 读文件内容并且写到 socket 之中。
   // 此处我们采用更高效的 sendfile 来完成文件的传输操作。
   //char c='\0';
@@ -298,15 +608,20 @@ int WriteStaticFile(int new_sock, const char* file_path)
   //{
   //    send(new_sock, &c, 1, 0);
   //}
-  ssize_t file_size=GetFileSize(file_path);
-  sendfile(new_sock, fd, NULL, file_size);
+  // 文件大小要从已经打开的 fd 上取，按路径再 stat 一次的话，
+  // 文件可能在这两步之间被替换或者截断。
+  struct stat st;
+  if(fstat(fd, &st) == 0)
+  {
+    ConnSendFile(conn, fd, st.st_size);
+  }
   // 4. 关闭文件
   close(fd);
   return 200;
 }
 
 // 处理静态文件
-int HandlerStaticFile(int new_sock, const HttpRequest* req)
+int HandlerStaticFile(HttpConn* conn, const HttpRequest* req)
 {
   // 1. 根据上面解析出的 url_path, 获取到对应的真实文件路径
   // 例如，此时 HTTP 服务器的根目录叫做 ./wwwroot
@@ -316,11 +631,11 @@ int HandlerStaticFile(int new_sock, const HttpRequest* req)
   // 根据下面的函数把 /image/101.jpg 转换成了磁盘上的 ./wwwroot/image/cat.jpg
   HandlerFilePath(req->url, file_path);
   // 2. 打开文件，把文件中的内容读取出来，并写入 socket 中。
-  int err_code=WriteStaticFile(new_sock, file_path);
+  int err_code=WriteStaticFile(conn, file_path);
   return err_code;
 }
 
-int HandlerCGIFather(int new_sock, int father_read, int father_write, const HttpRequest* req)
+int HandlerCGIFather(HttpConn* conn, int father_read, int father_write, const HttpRequest* req)
 { 
   //  a) 如果是 POST 请求，把 body 部分的数据读出来写到管道中,
   //     剩下的动态生成页面的过程都交给子进程来完成.
@@ -339,23 +654,36 @@ int HandlerCGIFather(int new_sock, int father_read, int father_write, const Http
     int i=0;
     for(; i<req->content_length;++i)
     {
-      read(new_sock, &c, 1);
+      ConnRecv(conn, &c, 1, 0);
       write(father_write, &c, 1);
     }
   }
   //  b) 构造 HTTP 响应中的首行， header ,空行
-  const char* first_line = "HTTP/1.1 200 OK\n";
-  send(new_sock, first_line, strlen(first_line), 0);
   // 此处为了简单,暂时先不管 header 
-  const char* blank_line = "\n";
-  send(new_sock, blank_line, strlen(blank_line), 0);
+  ConnSendHead(conn, 200, "OK", -1);
   //  c) 从管道中读取数据（子进程动态生成的页面），把这个数据写到
   //     socket 之中。
   //     此处也不太方便使用 sendfile ，主要是数据的长度不容易确定。
-  char c = '\0';
-  while(read(father_read, &c, 1) > 0)
+  //     每次读一整块再转发，TLS 下每次 ConnSend 都是一个单独的 record,
+  //     一个字节一个字节地发，额外的头部和校验会比数据本身还大。
+  char buf[SIZE];
+  ssize_t read_size = 0;
+  while((read_size = read(father_read, buf, sizeof(buf))) > 0)
   {
-    write(new_sock, &c, 1);
+    ssize_t offset = 0;
+    while(offset < read_size)
+    {
+      ssize_t send_size = ConnSend(conn, buf + offset, read_size - offset);
+      if(send_size <= 0)
+      {
+        break;
+      }
+      offset += send_size;
+    }
+    if(offset < read_size)
+    {
+      break;
+    }
   }
   //  d) 进程等待，回收子进程的资源。
   //  此处如果要进行进程等待，那么最好使用 waitpid, 保证当前线程回收的
@@ -424,7 +752,7 @@ int HandlerCGIChild(int child_read, int child_write, const HttpRequest* req)
 }
 
 // 处理动态页面
-int HandlerCGI(int new_sock, const HttpRequest* req)
+int HandlerCGI(HttpConn* conn, const HttpRequest* req)
 {
   // 1. 创建一对匿名管道
   int fd1[2],fd2[2];
@@ -450,7 +778,12 @@ int HandlerCGI(int new_sock, const HttpRequest* req)
     // 使用这个写端）
     close(child_read);
     close(child_write);
-    HandlerCGIFather(new_sock, father_read, father_write, req);
+    int err_code = HandlerCGIFather(conn, father_read, father_write, req);
+    // 父进程处理完就直接返回，不能再走到下面返回 404, 否则动态页面
+    // 后面还会再多拼上一个 404 页面。
+    close(father_read);
+    close(father_write);
+    return err_code;
   }
   else if(ret == 0)
   {
@@ -477,126 +810,1716 @@ END:
 }
 
 
-// 这个函数才是真正的完成一次请求的完整过程
-void HandlerRequest(int new_sock)
+// 根据请求的详细情况执行静态页面逻辑还是动态页面逻辑,
+// HTTP/1.1 的请求和 HTTP/2 的每个流都从这里进入。
+int HandlerDispatch(HttpConn* conn, const HttpRequest* req)
 {
-  // 1.读取请求并解析
-  //   a) 从 socket 中读出HTTP请求的首行。
-  int err_code = 200;
-  HttpRequest req;
-  memset(&req, 0, sizeof(req));
-  if(ReadLine(new_sock, req.first_line, sizeof(req.first_line)-1) < 0)
-  {
-    printf("ReadLine first_line failed!\n");
-    //对于错误的处理情况，统一返回404
-    err_code = 404;
-    goto END;
-    // 构造 404 响应的代码
-  }
-  //   b) 解析首行，获取到方法，url, 版本号(不用)。
-  if(ParseFirstLine(req.first_line, &req.method, &req.url) < 0)
-  {                                 // req.method 和 req.url 都是输出型参数
-    printf("ParseFirstLine failed! first_line=%s\n", req.first_line);
-    err_code = 404;
-    goto END;
-    // 构造 404 响应的代码
-  }
-  //   c) 对 url 再进行解析，解析出其中的 url_path, query_string
-  if(ParseQueryString(req.url, &req.url_path, &req.query_string) < 0)
-  {
-    printf("ParseQueryString failed! url=%s\n", req.url);
-    err_code = 404;
-    goto END;
-    // 构造 404 响应的代码
-  }
-  //   d) 读取并解析 header 部分(此处为了简单，只保留 content_length，
-  //      其它的 header 内容就直接丢弃了)。
-  if(HandlerHeader(new_sock, &req.content_length) < 0)
-  {
-    printf("HandlerHeader failed!\n");
-    err_code = 404;
-    goto END; 
-    // 构造 404 响应的代码
-  }
-  // 2.根据请求的详细情况执行静态页面逻辑还是动态页面逻辑
   //   a) 如果是 GET 请求，并且没有 query_string，就认为是静态页面。
   // Get, geT, gET 
-  if(strcasecmp(req.method, "GET")==0 && req.query_string == NULL)
+  if(strcasecmp(req->method, "GET")==0 && req->query_string == NULL)
   {
     // 处理静态页面
-    err_code=HandlerStaticFile(new_sock, &req);
+    return HandlerStaticFile(conn, req);
   }
   //   b) 如果是 GET 请求，并且有 query_string, 就可以根据 query_string
   //      参数的内容来动态计算生成页面了。
-  else if(strcasecmp(req.method, "GET")==0 && req.query_string != NULL)
+  else if(strcasecmp(req->method, "GET")==0 && req->query_string != NULL)
   {
     // 处理动态页面
-    err_code=HandlerCGI(new_sock, &req);
+    return HandlerCGI(conn, req);
   }
   //   c) 如果是 POST 请求，(一般没有query_string),都认为是动态页面。
-  else if(strcasecmp(req.method, "POST")==0)
+  else if(strcasecmp(req->method, "POST")==0)
   {
     // 处理动态页面
-    err_code=HandlerCGI(new_sock, &req);
+    return HandlerCGI(conn, req);
   }
   //   d) 既不是GET也不是POST
-  else 
+  printf("method not support! method=%s\n", req->method);
+  return 404;
+}
+
+// 下面是 HTTP/2 的实现。一个 HTTP/2 连接上可以同时跑很多个流(stream),
+// 每个流就相当于一次 HTTP/1.1 的请求和响应。
+// 当前连接所在的线程作为读线程，负责读帧、解析 HPACK 头部；每个流收齐
+// 头部后单独创建一个线程，复用上面的静态页面和 CGI 的处理逻辑。
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_FRAME_SIZE 16384           // 默认的最大帧长度，收发都不超过它
+#define H2_WINDOW_SIZE 65535          // 默认的初始流量控制窗口
+#define H2_MAX_STREAMS 100            // 一个连接上最多同时处理的流
+#define H2_HEADER_TABLE_SIZE 4096     // HPACK 动态表的默认大小
+#define H2_MAX_HEADER_BLOCK (64 * 1024)
+#define H2_CONN_WINDOW_SIZE (H2_MAX_STREAMS * H2_WINDOW_SIZE) // 我们通告的连接接收窗口
+#define H2_MAX_BODY (256 * 1024)      // 没有 content-length 的请求，一个流最多缓存的 body
+
+// 帧类型
+#define H2_DATA 0x0
+#define H2_HEADERS 0x1
+#define H2_PRIORITY 0x2
+#define H2_RST_STREAM 0x3
+#define H2_SETTINGS 0x4
+#define H2_PUSH_PROMISE 0x5
+#define H2_PING 0x6
+#define H2_GOAWAY 0x7
+#define H2_WINDOW_UPDATE 0x8
+#define H2_CONTINUATION 0x9
+
+// 帧标志
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+// 错误码
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_CANCEL 0x8
+#define H2_COMPRESSION_ERROR 0x9
+
+// SETTINGS 参数
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+
+// HPACK 静态表，下标就是 RFC 7541 中的索引，0 号不用
+typedef struct HpackStaticField
+{
+  const char* name;
+  const char* value;
+}HpackStaticField;
+
+static const HpackStaticField g_hpack_static[] = {
+  {"", ""},
+  {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+  {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+  {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+  {":status", "206"}, {":status", "304"}, {":status", "400"},
+  {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+  {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+  {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+  {"content-disposition", ""}, {"content-encoding", ""},
+  {"content-language", ""}, {"content-length", ""}, {"content-location", ""},
+  {"content-range", ""}, {"content-type", ""}, {"cookie", ""}, {"date", ""},
+  {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+  {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""},
+  {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+  {"link", ""}, {"location", ""}, {"max-forwards", ""},
+  {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""},
+  {"referer", ""}, {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+  {"set-cookie", ""}, {"strict-transport-security", ""},
+  {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+  {"www-authenticate", ""},
+};
+#define HPACK_STATIC_COUNT 61
+
+// HPACK 的 Huffman 编码是规范 Huffman 编码(canonical Huffman):
+// 码字按 (码长, 符号) 的顺序依次递增，所以只需要记录每个符号的码长，
+// 完整的码表在第一次使用时推算出来。下标 256 是 EOS.
+static const unsigned char g_huffman_len[257] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30,
+};
+#define HUFFMAN_MAX_LEN 30
+
+static uint32_t g_huffman_first[HUFFMAN_MAX_LEN + 1];  // 每种码长的第一个码字
+static uint32_t g_huffman_count[HUFFMAN_MAX_LEN + 1];  // 每种码长的码字个数
+static uint32_t g_huffman_offset[HUFFMAN_MAX_LEN + 1]; // 每种码长在 symbols 中的起始下标
+static uint16_t g_huffman_symbols[257];                 // 按 (码长, 符号) 排好序的符号
+static pthread_once_t g_huffman_once = PTHREAD_ONCE_INIT;
+
+void HuffmanInit()
+{
+  int sym = 0;
+  for(sym = 0; sym < 257; ++sym)
   {
-    printf("method not support! method=%s\n", req.method);
-    err_code = 404;
-    goto END;
-    // 构造 404 响应的代码
+    g_huffman_count[g_huffman_len[sym]]++;
   }
-END:
-  // 这次请求处理结束的收尾工作
-  if(err_code != 200)
+  uint32_t code = 0;
+  uint32_t offset = 0;
+  int len = 1;
+  for(len = 1; len <= HUFFMAN_MAX_LEN; ++len)
   {
-    Handler404(new_sock);
+    g_huffman_first[len] = code;
+    g_huffman_offset[len] = offset;
+    code = (code + g_huffman_count[len]) << 1;
+    for(sym = 0; sym < 257; ++sym)
+    {
+      if(g_huffman_len[sym] == len)
+      {
+        g_huffman_symbols[offset++] = sym;
+      }
+    }
   }
-
-  // 此处我们只考虑短链接。短连接的意思是每次客户端(浏览器)
-  // 给服务器发送请求之前，都是新建立一个 socket 进行连接。
-  // 对于短连接来说，如果响应写完了，就可以关闭 new_sock.
-  // 此处由于是服务器主动断开连接，也就进入 TIME_WAIT 状态。
-  // 由于服务器可能短时间内就处理了大量的连接，导致服务器上
-  // 出现了大量的 TIME_WAIT. 导致服务器没法处理新的连接。
-  // 所以需要设置 setsockopt REUSEADDR 来重用 TIME_WAIT 状态
-  // 的连接。
-  close(new_sock);
-  // 文件描述符关闭的前提是：该文件描述符不用了
 }
 
-void *ThreadEntry(void *arg)
+// Huffman 解码，成功返回解码后的长度
+ssize_t HuffmanDecode(const unsigned char* in, size_t in_len, char* out, size_t out_size)
 {
-  // 线程入口函数，负责这一次请求的完整过程。
-  int new_sock = (int64_t)arg; 
-  HandlerRequest(new_sock);
-  return NULL;
+  pthread_once(&g_huffman_once, HuffmanInit);
+  uint32_t code = 0;
+  int len = 0;
+  size_t out_len = 0;
+  size_t i = 0;
+  for(i = 0; i < in_len; ++i)
+  {
+    int bit = 7;
+    for(bit = 7; bit >= 0; --bit)
+    {
+      code = (code << 1) | ((in[i] >> bit) & 1);
+      ++len;
+      if(len > HUFFMAN_MAX_LEN)
+      {
+        return -1;
+      }
+      // 当前的 code 落在这个码长的码字范围内，就找到了一个符号
+      if(code - g_huffman_first[len] < g_huffman_count[len])
+      {
+        uint16_t sym = g_huffman_symbols[g_huffman_offset[len] + code - g_huffman_first[len]];
+        if(sym == 256 || out_len >= out_size)
+        {
+          return -1;
+        }
+        out[out_len++] = sym;
+        code = 0;
+        len = 0;
+      }
+    }
+  }
+  // 末尾的填充必须是 EOS 的前缀(全为 1), 并且不超过 7 位
+  if(len > 7 || code != (1u << len) - 1)
+  {
+    return -1;
+  }
+  return out_len;
 }
 
-void HttpServerStart(const char* ip, short port)
+// 解析 HPACK 中的整数，prefix 是第一个字节中可用的位数
+int HpackDecodeInt(const unsigned char** p, const unsigned char* end, int prefix, uint32_t* value)
 {
-  // 1. 创建 tcp socket 
-  int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
-  if(listen_sock < 0)
+  if(*p >= end)
   {
-    perror("socket");
-    return;
+    return -1;
   }
-
-  // 设置 REUSERADDR,处理后面短连接主动关闭 socket 的问题。
-  int opt = 1; // 启动 setsockopt 这个功能
-  setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-
-  // 2. 绑定端口号
-  sockaddr_in addr;
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = inet_addr(ip);
-  addr.sin_port = htons(port);
-  int ret = bind(listen_sock, (sockaddr*)&addr, sizeof(addr));
-  if(ret < 0)
+  uint32_t max = (1u << prefix) - 1;
+  uint32_t v = **p & max;
+  ++*p;
+  if(v < max)
   {
-    perror("bind");
+    *value = v;
+    return 0;
+  }
+  int shift = 0;
+  while(*p < end && shift <= 21)
+  {
+    unsigned char b = **p;
+    ++*p;
+    v += (uint32_t)(b & 0x7f) << shift;
+    shift += 7;
+    if((b & 0x80) == 0)
+    {
+      *value = v;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+size_t HpackEncodeInt(unsigned char* buf, uint32_t value, int prefix, unsigned char flags)
+{
+  uint32_t max = (1u << prefix) - 1;
+  if(value < max)
+  {
+    buf[0] = flags | value;
+    return 1;
+  }
+  size_t len = 0;
+  buf[len++] = flags | max;
+  value -= max;
+  while(value >= 0x80)
+  {
+    buf[len++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  buf[len++] = value;
+  return len;
+}
+
+// 解析 HPACK 中的字符串，结果以 \0 结尾放到 out 中
+int HpackDecodeString(const unsigned char** p, const unsigned char* end, char* out, size_t out_size)
+{
+  if(*p >= end)
+  {
+    return -1;
+  }
+  int huffman = **p & 0x80;
+  uint32_t len = 0;
+  if(HpackDecodeInt(p, end, 7, &len) < 0 || len > (size_t)(end - *p))
+  {
+    return -1;
+  }
+  ssize_t out_len = len;
+  if(huffman)
+  {
+    out_len = HuffmanDecode(*p, len, out, out_size - 1);
+  }
+  else if(len < out_size)
+  {
+    memcpy(out, *p, len);
+  }
+  else
+  {
+    out_len = -1;
+  }
+  if(out_len < 0)
+  {
+    return -1;
+  }
+  out[out_len] = '\0';
+  *p += len;
+  return 0;
+}
+
+// HPACK 动态表，用环形数组保存，head 是最新插入的条目。
+// 每个条目至少占 32 字节，所以条目个数不会超过 表大小 / 32.
+#define HPACK_MAX_FIELDS (H2_HEADER_TABLE_SIZE / 32)
+
+typedef struct HpackField
+{
+  char* name;
+  char* value;
+  size_t size;   // name 长度 + value 长度 + 32
+}HpackField;
+
+typedef struct HpackTable
+{
+  HpackField fields[HPACK_MAX_FIELDS];
+  int head;
+  int count;
+  size_t size;
+  size_t max_size;
+}HpackTable;
+
+void HpackEvict(HpackTable* table, size_t max_size)
+{
+  while(table->count > 0 && table->size > max_size)
+  {
+    HpackField* field = &table->fields[(table->head + table->count - 1) % HPACK_MAX_FIELDS];
+    table->size -= field->size;
+    free(field->name);
+    free(field->value);
+    table->count--;
+  }
+}
+
+void HpackInsert(HpackTable* table, const char* name, const char* value)
+{
+  size_t size = strlen(name) + strlen(value) + 32;
+  if(size > table->max_size)
+  {
+    // 比整个表还大的条目，插入的结果就是清空动态表
+    HpackEvict(table, 0);
+    return;
+  }
+  HpackEvict(table, table->max_size - size);
+  table->head = (table->head + HPACK_MAX_FIELDS - 1) % HPACK_MAX_FIELDS;
+  HpackField* field = &table->fields[table->head];
+  field->name = strdup(name);
+  field->value = strdup(value);
+  field->size = size;
+  table->count++;
+  table->size += size;
+}
+
+// 根据索引从静态表或者动态表中查找
+int HpackLookup(const HpackTable* table, uint32_t index, const char** name, const char** value)
+{
+  if(index == 0)
+  {
+    return -1;
+  }
+  if(index <= HPACK_STATIC_COUNT)
+  {
+    *name = g_hpack_static[index].name;
+    *value = g_hpack_static[index].value;
+    return 0;
+  }
+  index -= HPACK_STATIC_COUNT + 1;
+  if(index >= (uint32_t)table->count)
+  {
+    return -1;
+  }
+  const HpackField* field = &table->fields[(table->head + index) % HPACK_MAX_FIELDS];
+  *name = field->name;
+  *value = field->value;
+  return 0;
+}
+
+// 在静态表中查找 name 和 value 都相同的条目，找不到返回 0
+uint32_t HpackStaticIndex(const char* name, const char* value)
+{
+  uint32_t index = 1;
+  for(index = 1; index <= HPACK_STATIC_COUNT; ++index)
+  {
+    if(strcmp(g_hpack_static[index].name, name) == 0
+        && strcmp(g_hpack_static[index].value, value) == 0)
+    {
+      return index;
+    }
+  }
+  return 0;
+}
+
+typedef void (*HpackCallback)(void* arg, const char* name, const char* value);
+
+// 解码一个完整的头部块，每解出一个头部就调用一次 callback.
+// 即使这个流最后被拒绝了，头部块也必须解码，否则动态表就和对端不一致了。
+int HpackDecode(HpackTable* table, const unsigned char* block, size_t len,
+    HpackCallback callback, void* arg)
+{
+  const unsigned char* p = block;
+  const unsigned char* end = block + len;
+  char name[SIZE];
+  char value[SIZE];
+  while(p < end)
+  {
+    uint32_t index = 0;
+    const char* table_name = NULL;
+    const char* table_value = NULL;
+    if(*p & 0x80)
+    {
+      // 1xxxxxxx 索引表示：头部的 name 和 value 都在表中
+      if(HpackDecodeInt(&p, end, 7, &index) < 0
+          || HpackLookup(table, index, &table_name, &table_value) < 0)
+      {
+        return -1;
+      }
+      callback(arg, table_name, table_value);
+      continue;
+    }
+    if((*p & 0xe0) == 0x20)
+    {
+      // 001xxxxx 动态表大小更新，不能超过我们在 SETTINGS 中允许的大小
+      if(HpackDecodeInt(&p, end, 5, &index) < 0 || index > H2_HEADER_TABLE_SIZE)
+      {
+        return -1;
+      }
+      table->max_size = index;
+      HpackEvict(table, table->max_size);
+      continue;
+    }
+    // 01xxxxxx 带增量索引的字面值，解出来之后要插入动态表；
+    // 0000xxxx 不索引的字面值，0001xxxx 永不索引的字面值。
+    int indexing = (*p & 0x40) != 0;
+    if(HpackDecodeInt(&p, end, indexing ? 6 : 4, &index) < 0)
+    {
+      return -1;
+    }
+    if(index == 0)
+    {
+      if(HpackDecodeString(&p, end, name, sizeof(name)) < 0)
+      {
+        return -1;
+      }
+    }
+    else
+    {
+      // 插入动态表时可能会把引用的条目淘汰掉，所以先拷贝出来
+      if(HpackLookup(table, index, &table_name, &table_value) < 0
+          || strlen(table_name) >= sizeof(name))
+      {
+        return -1;
+      }
+      strcpy(name, table_name);
+    }
+    if(HpackDecodeString(&p, end, value, sizeof(value)) < 0)
+    {
+      return -1;
+    }
+    if(indexing)
+    {
+      HpackInsert(table, name, value);
+    }
+    callback(arg, name, value);
+  }
+  return 0;
+}
+
+// 一个 HTTP/2 连接
+typedef struct H2Session
+{
+  HttpConn* conn;               // 底层的 TCP/TLS 连接
+  pthread_mutex_t ssl_lock;     // TLS 连接时交给 conn->ssl_lock 使用
+  pthread_mutex_t write_lock;   // 保证一个帧完整写完之后才写下一个帧
+  pthread_mutex_t lock;         // 保护流表、流量控制窗口以及流的请求 body
+  pthread_cond_t cond;          // 窗口变大、body 到达、流结束时通知
+  H2Stream* streams;
+  int stream_count;
+  uint32_t last_stream_id;
+  int64_t send_window;          // 连接级别的发送窗口
+  int64_t peer_initial_window;  // 对端 SETTINGS 中的流初始窗口
+  int goaway;                   // 对端发了 GOAWAY, 不再接受新的流
+  int closed;                   // 连接已经断开
+  int64_t recv_window;          // 连接级别的接收窗口，对端还能发多少 DATA
+  size_t recv_unacked;          // 已经从缓冲区读走，但还没有归还给对端的字节数
+  // 下面的字段只有读线程使用，不需要加锁
+  HpackTable hpack;
+  unsigned char* header_block;  // 正在拼接的头部块(HEADERS + CONTINUATION)
+  size_t header_len;
+  uint32_t header_stream_id;    // 不为 0 表示还在等 CONTINUATION
+  int header_flags;
+}H2Session;
+
+struct H2Stream
+{
+  uint32_t id;
+  H2Session* session;
+  H2Stream* next;
+  char method[32];
+  char path[SIZE];
+  int content_length;           // -1 表示请求中没有带 content-length
+  // 请求 body, 读线程写入，处理线程读出
+  char* body;
+  size_t body_len;
+  size_t body_pos;
+  int body_done;
+  int64_t recv_window;          // 流级别的接收窗口
+  size_t recv_unacked;          // 已经读出，但还没有通过 WINDOW_UPDATE 归还给对端的字节数
+  int reset;                    // 对端发了 RST_STREAM, 或者我们重置了这个流
+  int64_t send_window;
+  int head_sent;                // 只有处理线程使用
+};
+
+int H2WriteAll(HttpConn* conn, const void* buf, size_t len)
+{
+  const char* p = buf;
+  while(len > 0)
+  {
+    ssize_t ret = ConnSend(conn, p, len);
+    if(ret <= 0)
+    {
+      return -1;
+    }
+    p += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+int H2ReadAll(HttpConn* conn, void* buf, size_t len)
+{
+  char* p = buf;
+  while(len > 0)
+  {
+    ssize_t ret = ConnRecv(conn, p, len, 0);
+    if(ret <= 0)
+    {
+      return -1;
+    }
+    p += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+// 帧头：3 字节长度，1 字节类型，1 字节标志，4 字节流 id
+void H2PutFrameHeader(unsigned char* buf, size_t len, int type, int flags, uint32_t stream_id)
+{
+  buf[0] = len >> 16;
+  buf[1] = len >> 8;
+  buf[2] = len;
+  buf[3] = type;
+  buf[4] = flags;
+  buf[5] = (stream_id >> 24) & 0x7f;
+  buf[6] = stream_id >> 16;
+  buf[7] = stream_id >> 8;
+  buf[8] = stream_id;
+}
+
+uint32_t H2GetUint32(const unsigned char* p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+void H2PutUint32(unsigned char* p, uint32_t value)
+{
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+// 帧只写出去一部分时，对端会把之后任何流的帧都当成这个帧剩下的负载，
+// 连接已经没法再用了。关掉 socket 保证不会再写出任何东西，并唤醒所有
+// 等待的线程。调用时需要持有 session->write_lock.
+void H2AbortSession(H2Session* session)
+{
+  shutdown(session->conn->sock, SHUT_RDWR);
+  pthread_mutex_lock(&session->lock);
+  session->closed = 1;
+  pthread_cond_broadcast(&session->cond);
+  pthread_mutex_unlock(&session->lock);
+}
+
+// 写一个完整的帧，len 不能超过 H2_FRAME_SIZE.
+// 帧头和负载拼在一起只写一次，TLS 下也就只产生一个 record.
+int H2WriteFrame(H2Session* session, int type, int flags, uint32_t stream_id,
+    const void* payload, size_t len)
+{
+  unsigned char buf[9 + H2_FRAME_SIZE];
+  H2PutFrameHeader(buf, len, type, flags, stream_id);
+  if(len > 0)
+  {
+    memcpy(buf + 9, payload, len);
+  }
+  pthread_mutex_lock(&session->write_lock);
+  int ret = H2WriteAll(session->conn, buf, 9 + len);
+  if(ret < 0)
+  {
+    H2AbortSession(session);
+  }
+  pthread_mutex_unlock(&session->write_lock);
+  return ret;
+}
+
+int H2SendWindowUpdate(H2Session* session, uint32_t stream_id, uint32_t increment)
+{
+  unsigned char payload[4];
+  H2PutUint32(payload, increment);
+  return H2WriteFrame(session, H2_WINDOW_UPDATE, 0, stream_id, payload, sizeof(payload));
+}
+
+int H2SendRstStream(H2Session* session, uint32_t stream_id, uint32_t error_code)
+{
+  unsigned char payload[4];
+  H2PutUint32(payload, error_code);
+  return H2WriteFrame(session, H2_RST_STREAM, 0, stream_id, payload, sizeof(payload));
+}
+
+int H2SendGoaway(H2Session* session, uint32_t error_code)
+{
+  unsigned char payload[8];
+  H2PutUint32(payload, session->last_stream_id);
+  H2PutUint32(payload + 4, error_code);
+  return H2WriteFrame(session, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+}
+
+// 调用前需要持有 session->lock
+H2Stream* H2FindStream(H2Session* session, uint32_t stream_id)
+{
+  H2Stream* stream = session->streams;
+  for(; stream != NULL; stream = stream->next)
+  {
+    if(stream->id == stream_id)
+    {
+      return stream;
+    }
+  }
+  return NULL;
+}
+
+// 等待连接和流的发送窗口都大于 0, 然后从中扣掉最多 want 个字节。
+// 返回扣掉的字节数，流被重置或者连接断开时返回 -1.
+ssize_t H2AcquireWindow(H2Stream* stream, size_t want)
+{
+  H2Session* session = stream->session;
+  pthread_mutex_lock(&session->lock);
+  while(!stream->reset && !session->closed
+      && (session->send_window <= 0 || stream->send_window <= 0))
+  {
+    pthread_cond_wait(&session->cond, &session->lock);
+  }
+  if(stream->reset || session->closed)
+  {
+    pthread_mutex_unlock(&session->lock);
+    return -1;
+  }
+  int64_t n = want;
+  if(n > session->send_window)
+  {
+    n = session->send_window;
+  }
+  if(n > stream->send_window)
+  {
+    n = stream->send_window;
+  }
+  if(n > H2_FRAME_SIZE)
+  {
+    n = H2_FRAME_SIZE;
+  }
+  session->send_window -= n;
+  stream->send_window -= n;
+  pthread_mutex_unlock(&session->lock);
+  return n;
+}
+
+// 流被重置或者连接已经断开时返回 0, 此后这个流上不能再发送任何帧
+int H2StreamWritable(H2Stream* stream)
+{
+  H2Session* session = stream->session;
+  pthread_mutex_lock(&session->lock);
+  int writable = !stream->reset && !session->closed;
+  pthread_mutex_unlock(&session->lock);
+  return writable;
+}
+
+// 按流量控制窗口把数据切成 DATA 帧发出去
+int H2SendData(H2Stream* stream, const char* buf, size_t len, int end_stream)
+{
+  do
+  {
+    ssize_t n = 0;
+    if(len > 0)
+    {
+      n = H2AcquireWindow(stream, len);
+      if(n < 0)
+      {
+        return -1;
+      }
+    }
+    else if(!H2StreamWritable(stream))
+    {
+      // 空的 DATA 帧不需要窗口，但同样不能发到已经重置的流上
+      return -1;
+    }
+    int flags = (end_stream && (size_t)n == len) ? H2_FLAG_END_STREAM : 0;
+    if(H2WriteFrame(stream->session, H2_DATA, flags, stream->id, buf, n) < 0)
+    {
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  } while(len > 0);
+  return 0;
+}
+
+int H2StreamSendHead(H2Stream* stream, int status, ssize_t content_length)
+{
+  if(stream->head_sent)
+  {
+    return 0;
+  }
+  if(!H2StreamWritable(stream))
+  {
+    return -1;
+  }
+  stream->head_sent = 1;
+  // 响应头部很少，直接用静态表的索引或者不索引的字面值来编码，
+  // 这样就不需要维护编码端的动态表了。
+  unsigned char block[64];
+  size_t len = 0;
+  char value[32];
+  sprintf(value, "%d", status);
+  uint32_t index = HpackStaticIndex(":status", value);
+  if(index > 0)
+  {
+    len += HpackEncodeInt(block + len, index, 7, 0x80);
+  }
+  else
+  {
+    len += HpackEncodeInt(block + len, HpackStaticIndex(":status", "200"), 4, 0x00);
+    len += HpackEncodeInt(block + len, strlen(value), 7, 0x00);
+    memcpy(block + len, value, strlen(value));
+    len += strlen(value);
+  }
+  if(content_length >= 0)
+  {
+    sprintf(value, "%ld", content_length);
+    len += HpackEncodeInt(block + len, HpackStaticIndex("content-length", ""), 4, 0x00);
+    len += HpackEncodeInt(block + len, strlen(value), 7, 0x00);
+    memcpy(block + len, value, strlen(value));
+    len += strlen(value);
+  }
+  return H2WriteFrame(stream->session, H2_HEADERS, H2_FLAG_END_HEADERS, stream->id, block, len);
+}
+
+ssize_t H2StreamSend(H2Stream* stream, const void* buf, size_t len)
+{
+  if(H2SendData(stream, buf, len, 0) < 0)
+  {
+    return -1;
+  }
+  return len;
+}
+
+// 静态文件按窗口大小分块，每块先写 DATA 帧头，再用底层连接的
+// ConnSendFile 把文件内容直接写到 socket 上，明文和 kTLS 下都是零拷贝。
+ssize_t H2StreamSendFile(H2Stream* stream, int fd, size_t size)
+{
+  H2Session* session = stream->session;
+  size_t total = 0;
+  while(total < size)
+  {
+    ssize_t n = H2AcquireWindow(stream, size - total);
+    if(n < 0)
+    {
+      return -1;
+    }
+    unsigned char header[9];
+    H2PutFrameHeader(header, n, H2_DATA, 0, stream->id);
+    pthread_mutex_lock(&session->write_lock);
+    // 帧头已经声明了 n 个字节，文件在发送过程中被截断等原因导致没有
+    // 写够时，这个帧就不完整了，只能断开整个连接。
+    int ret = H2WriteAll(session->conn, header, sizeof(header));
+    if(ret == 0 && ConnSendFile(session->conn, fd, n) != n)
+    {
+      ret = -1;
+    }
+    if(ret < 0)
+    {
+      H2AbortSession(session);
+    }
+    pthread_mutex_unlock(&session->write_lock);
+    if(ret < 0)
+    {
+      return -1;
+    }
+    total += n;
+  }
+  return total;
+}
+
+// 缓冲区中的 n 个字节被读走或者丢弃了，累计到半个窗口时返回需要
+// 通过 WINDOW_UPDATE 归还给对端的连接窗口大小。调用前需要持有 session->lock
+uint32_t H2ReleaseRecvWindow(H2Session* session, size_t n)
+{
+  session->recv_unacked += n;
+  if(session->recv_unacked < H2_WINDOW_SIZE / 2)
+  {
+    return 0;
+  }
+  uint32_t increment = session->recv_unacked;
+  session->recv_window += increment;
+  session->recv_unacked = 0;
+  return increment;
+}
+
+// 读请求 body, 没有数据时阻塞等待读线程收到 DATA 帧
+ssize_t H2StreamRecv(H2Stream* stream, void* buf, size_t len, int flags)
+{
+  H2Session* session = stream->session;
+  pthread_mutex_lock(&session->lock);
+  while(stream->body_pos == stream->body_len && !stream->body_done
+      && !stream->reset && !session->closed)
+  {
+    pthread_cond_wait(&session->cond, &session->lock);
+  }
+  size_t n = stream->body_len - stream->body_pos;
+  if(n > len)
+  {
+    n = len;
+  }
+  memcpy(buf, stream->body + stream->body_pos, n);
+  uint32_t increment = 0;
+  uint32_t conn_increment = 0;
+  if((flags & MSG_PEEK) == 0)
+  {
+    stream->body_pos += n;
+    // 数据被读走之后才把窗口归还给对端，这样缓存的数据不会超过窗口。
+    // 攒到半个窗口再归还，避免每个字节都发一个 WINDOW_UPDATE
+    stream->recv_unacked += n;
+    if(stream->recv_unacked >= H2_WINDOW_SIZE / 2 && !stream->body_done)
+    {
+      increment = stream->recv_unacked;
+      stream->recv_window += increment;
+      stream->recv_unacked = 0;
+    }
+    conn_increment = H2ReleaseRecvWindow(session, n);
+  }
+  pthread_mutex_unlock(&session->lock);
+  if(increment > 0)
+  {
+    H2SendWindowUpdate(session, stream->id, increment);
+  }
+  if(conn_increment > 0)
+  {
+    H2SendWindowUpdate(session, 0, conn_increment);
+  }
+  return n > 0 ? (ssize_t)n : -1;
+}
+
+// 处理线程的入口，一个流就是一次完整的请求
+void* H2StreamEntry(void* arg)
+{
+  H2Stream* stream = arg;
+  H2Session* session = stream->session;
+  HttpConn conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.sock = session->conn->sock;
+  conn.stream = stream;
+
+  // 把 :method 和 :path 拼成和 HTTP/1.1 首行解析之后一样的结果
+  HttpRequest req;
+  memset(&req, 0, sizeof(req));
+  size_t method_len = strlen(stream->method);
+  strcpy(req.first_line, stream->method);
+  req.method = req.first_line;
+  req.url = req.first_line + method_len + 1;
+  snprintf(req.url, sizeof(req.first_line) - method_len - 1, "%s", stream->path);
+  ParseQueryString(req.url, &req.url_path, &req.query_string);
+  req.content_length = stream->content_length;
+  if(req.content_length < 0 && strcasecmp(req.method, "POST") != 0)
+  {
+    // 只有 POST 会把 body 交给 CGI, 其它请求不需要知道 body 的长度
+    req.content_length = 0;
+  }
+  else if(req.content_length < 0)
+  {
+    // HTTP/2 的请求可以不带 content-length, 此时等 body 全部收完，
+    // 以收到的长度作为 content_length.
+    pthread_mutex_lock(&session->lock);
+    while(!stream->body_done && !stream->reset && !session->closed)
+    {
+      pthread_cond_wait(&session->cond, &session->lock);
+    }
+    req.content_length = stream->body_len;
+    pthread_mutex_unlock(&session->lock);
+  }
+
+  int err_code = HandlerDispatch(&conn, &req);
+  if(err_code != 200)
+  {
+    Handler404(&conn);
+  }
+  // 用一个空的 DATA 帧带上 END_STREAM 表示响应结束
+  H2SendData(stream, "", 0, 1);
+  // 响应已经发完，但请求 body 还没有收完(例如带 body 的 GET 请求),
+  // 要用 RST_STREAM(NO_ERROR) 告诉客户端不用再发了，否则它用完流的
+  // 窗口之后就会一直等 WINDOW_UPDATE.
+  pthread_mutex_lock(&session->lock);
+  int rst = !stream->body_done && !stream->reset && !session->closed;
+  if(rst)
+  {
+    stream->reset = 1;
+  }
+  pthread_mutex_unlock(&session->lock);
+  if(rst)
+  {
+    H2SendRstStream(session, stream->id, H2_NO_ERROR);
+  }
+
+  // 处理线程没有读完的 body 也要把连接窗口归还
+  pthread_mutex_lock(&session->lock);
+  uint32_t conn_increment = H2ReleaseRecvWindow(session, stream->body_len - stream->body_pos);
+  pthread_mutex_unlock(&session->lock);
+  if(conn_increment > 0)
+  {
+    H2SendWindowUpdate(session, 0, conn_increment);
+  }
+
+  pthread_mutex_lock(&session->lock);
+  H2Stream** p = &session->streams;
+  while(*p != stream)
+  {
+    p = &(*p)->next;
+  }
+  *p = stream->next;
+  session->stream_count--;
+  pthread_cond_broadcast(&session->cond);
+  pthread_mutex_unlock(&session->lock);
+  free(stream->body);
+  free(stream);
+  return NULL;
+}
+
+void H2OnHeaderField(void* arg, const char* name, const char* value)
+{
+  H2Stream* stream = arg;
+  if(strcmp(name, ":method") == 0)
+  {
+    snprintf(stream->method, sizeof(stream->method), "%s", value);
+  }
+  else if(strcmp(name, ":path") == 0)
+  {
+    snprintf(stream->path, sizeof(stream->path), "%s", value);
+  }
+  else if(strcmp(name, "content-length") == 0)
+  {
+    stream->content_length = atoi(value);
+  }
+}
+
+H2Stream* H2NewStream(H2Session* session, uint32_t stream_id)
+{
+  H2Stream* stream = calloc(1, sizeof(H2Stream));
+  stream->id = stream_id;
+  stream->session = session;
+  stream->content_length = -1;
+  stream->send_window = session->peer_initial_window;
+  stream->recv_window = H2_WINDOW_SIZE;
+  return stream;
+}
+
+// 把流加入流表，并创建处理线程
+int H2StartStream(H2Session* session, H2Stream* stream)
+{
+  pthread_mutex_lock(&session->lock);
+  if(session->stream_count >= H2_MAX_STREAMS)
+  {
+    pthread_mutex_unlock(&session->lock);
+    return -1;
+  }
+  stream->send_window = session->peer_initial_window;
+  stream->next = session->streams;
+  session->streams = stream;
+  session->stream_count++;
+  pthread_t tid;
+  if(pthread_create(&tid, NULL, H2StreamEntry, stream) != 0)
+  {
+    session->streams = stream->next;
+    session->stream_count--;
+    pthread_mutex_unlock(&session->lock);
+    return -1;
+  }
+  pthread_detach(tid);
+  pthread_mutex_unlock(&session->lock);
+  return 0;
+}
+
+// 一个完整的头部块收齐了：新的请求就创建流，已有的流就是 trailer
+int H2OnHeaderBlock(H2Session* session)
+{
+  uint32_t stream_id = session->header_stream_id;
+  int end_stream = session->header_flags & H2_FLAG_END_STREAM;
+  session->header_stream_id = 0;
+  H2Stream* stream = H2NewStream(session, stream_id);
+  if(HpackDecode(&session->hpack, session->header_block, session->header_len,
+        H2OnHeaderField, stream) < 0)
+  {
+    free(stream);
+    return H2_COMPRESSION_ERROR;
+  }
+  if(stream_id <= session->last_stream_id)
+  {
+    // trailer 里的内容不关心，只需要知道 body 结束了
+    free(stream);
+    pthread_mutex_lock(&session->lock);
+    H2Stream* exist = H2FindStream(session, stream_id);
+    if(exist != NULL && end_stream)
+    {
+      exist->body_done = 1;
+      pthread_cond_broadcast(&session->cond);
+    }
+    pthread_mutex_unlock(&session->lock);
+    return 0;
+  }
+  session->last_stream_id = stream_id;
+  if(stream->method[0] == '\0' || stream->path[0] == '\0')
+  {
+    free(stream);
+    H2SendRstStream(session, stream_id, H2_PROTOCOL_ERROR);
+    return 0;
+  }
+  stream->body_done = end_stream;
+  // 没有 content-length 的请求，处理线程要等 body 收完才开始读，
+  // 窗口不会随着读取归还，所以一开始就把流的窗口放大到固定的上限。
+  int enlarge = stream->content_length < 0 && !end_stream;
+  if(enlarge)
+  {
+    stream->recv_window = H2_MAX_BODY;
+  }
+  if(session->goaway || H2StartStream(session, stream) < 0)
+  {
+    free(stream);
+    H2SendRstStream(session, stream_id, H2_REFUSED_STREAM);
+  }
+  else if(enlarge)
+  {
+    H2SendWindowUpdate(session, stream_id, H2_MAX_BODY - H2_WINDOW_SIZE);
+  }
+  return 0;
+}
+
+int H2AppendHeaderBlock(H2Session* session, const unsigned char* data, size_t len)
+{
+  if(session->header_len + len > H2_MAX_HEADER_BLOCK)
+  {
+    return -1;
+  }
+  session->header_block = realloc(session->header_block, session->header_len + len);
+  memcpy(session->header_block + session->header_len, data, len);
+  session->header_len += len;
+  return 0;
+}
+
+// 去掉 PADDED 标志带来的填充，成功返回 0
+int H2StripPadding(int flags, const unsigned char** data, size_t* len)
+{
+  if((flags & H2_FLAG_PADDED) == 0)
+  {
+    return 0;
+  }
+  if(*len < 1 || (*data)[0] >= *len)
+  {
+    return -1;
+  }
+  *len -= 1 + (*data)[0];
+  *data += 1;
+  return 0;
+}
+
+int H2OnHeaders(H2Session* session, int flags, uint32_t stream_id,
+    const unsigned char* payload, size_t len)
+{
+  if(stream_id == 0 || stream_id % 2 == 0)
+  {
+    // 客户端发起的流 id 必须是奇数
+    return H2_PROTOCOL_ERROR;
+  }
+  if(H2StripPadding(flags, &payload, &len) < 0)
+  {
+    return H2_PROTOCOL_ERROR;
+  }
+  if(flags & H2_FLAG_PRIORITY)
+  {
+    // 优先级信息直接忽略
+    if(len < 5)
+    {
+      return H2_FRAME_SIZE_ERROR;
+    }
+    payload += 5;
+    len -= 5;
+  }
+  session->header_len = 0;
+  session->header_stream_id = stream_id;
+  session->header_flags = flags;
+  if(H2AppendHeaderBlock(session, payload, len) < 0)
+  {
+    return H2_PROTOCOL_ERROR;
+  }
+  if(flags & H2_FLAG_END_HEADERS)
+  {
+    return H2OnHeaderBlock(session);
+  }
+  return 0;
+}
+
+int H2OnContinuation(H2Session* session, int flags, uint32_t stream_id,
+    const unsigned char* payload, size_t len)
+{
+  if(session->header_stream_id == 0 || stream_id != session->header_stream_id)
+  {
+    return H2_PROTOCOL_ERROR;
+  }
+  if(H2AppendHeaderBlock(session, payload, len) < 0)
+  {
+    return H2_PROTOCOL_ERROR;
+  }
+  if(flags & H2_FLAG_END_HEADERS)
+  {
+    return H2OnHeaderBlock(session);
+  }
+  return 0;
+}
+
+int H2OnData(H2Session* session, int flags, uint32_t stream_id,
+    const unsigned char* payload, size_t len)
+{
+  if(stream_id == 0 || stream_id > session->last_stream_id)
+  {
+    // 还没有打开过的流(idle)上不能出现 DATA
+    return H2_PROTOCOL_ERROR;
+  }
+  size_t frame_len = len;
+  if(H2StripPadding(flags, &payload, &len) < 0)
+  {
+    return H2_PROTOCOL_ERROR;
+  }
+  // 流量控制按整个帧的负载(包括填充)计算。超出我们通告的连接窗口是
+  // 连接错误，超出流的窗口只是流错误。两种窗口都等数据从缓冲区读走后
+  // 再归还，所以一个连接上缓存的数据不会超过 H2_CONN_WINDOW_SIZE.
+  pthread_mutex_lock(&session->lock);
+  if((int64_t)frame_len > session->recv_window)
+  {
+    pthread_mutex_unlock(&session->lock);
+    return H2_FLOW_CONTROL_ERROR;
+  }
+  session->recv_window -= frame_len;
+  size_t dropped = frame_len;   // 没有进入缓冲区的字节，连接窗口可以直接归还
+  uint32_t increment = 0;
+  int rst = 0;                  // 不为 0 时是 RST_STREAM 的错误码
+  H2Stream* stream = H2FindStream(session, stream_id);
+  // 流已经处理完了，或者已经被重置了，数据直接丢掉
+  if(stream != NULL && !stream->body_done && !stream->reset)
+  {
+    if((int64_t)frame_len > stream->recv_window)
+    {
+      stream->reset = 1;
+      rst = H2_FLOW_CONTROL_ERROR;
+    }
+    else
+    {
+      stream->recv_window -= frame_len;
+      if(stream->body_pos > 0)
+      {
+        memmove(stream->body, stream->body + stream->body_pos,
+            stream->body_len - stream->body_pos);
+        stream->body_len -= stream->body_pos;
+        stream->body_pos = 0;
+      }
+      stream->body = realloc(stream->body, stream->body_len + len + 1);
+      memcpy(stream->body + stream->body_len, payload, len);
+      stream->body_len += len;
+      stream->body_done = flags & H2_FLAG_END_STREAM;
+      // 填充不会进入缓冲区，流窗口中的这部分立即归还
+      dropped = frame_len - len;
+      if(dropped > 0 && !stream->body_done)
+      {
+        increment = dropped;
+        stream->recv_window += increment;
+      }
+      // 没有 content-length 的请求把 H2_MAX_BODY 用完了还没结束，
+      // 窗口不会再归还，继续等下去两边都会卡死，只能取消这个流
+      if(stream->content_length < 0 && !stream->body_done && stream->recv_window <= 0)
+      {
+        stream->reset = 1;
+        rst = H2_CANCEL;
+      }
+    }
+    pthread_cond_broadcast(&session->cond);
+  }
+  uint32_t conn_increment = H2ReleaseRecvWindow(session, dropped);
+  pthread_mutex_unlock(&session->lock);
+  if(rst)
+  {
+    H2SendRstStream(session, stream_id, rst);
+  }
+  else if(increment > 0)
+  {
+    H2SendWindowUpdate(session, stream_id, increment);
+  }
+  if(conn_increment > 0)
+  {
+    H2SendWindowUpdate(session, 0, conn_increment);
+  }
+  return 0;
+}
+
+// 应用 SETTINGS 中的参数，我们只关心流的初始窗口大小
+int H2ApplySettings(H2Session* session, const unsigned char* payload, size_t len)
+{
+  if(len % 6 != 0)
+  {
+    return H2_FRAME_SIZE_ERROR;
+  }
+  size_t i = 0;
+  for(i = 0; i < len; i += 6)
+  {
+    int id = (payload[i] << 8) | payload[i + 1];
+    uint32_t value = H2GetUint32(payload + i + 2);
+    if(id == H2_SETTINGS_INITIAL_WINDOW_SIZE)
+    {
+      if(value > 0x7fffffff)
+      {
+        return H2_FLOW_CONTROL_ERROR;
+      }
+      // 初始窗口变化时，所有已经存在的流的窗口都要加上差值，
+      // 加完之后任何一个窗口超过 2^31-1 都是连接错误
+      pthread_mutex_lock(&session->lock);
+      int64_t delta = (int64_t)value - session->peer_initial_window;
+      H2Stream* stream = session->streams;
+      for(; stream != NULL; stream = stream->next)
+      {
+        if(stream->send_window + delta > 0x7fffffff)
+        {
+          pthread_mutex_unlock(&session->lock);
+          return H2_FLOW_CONTROL_ERROR;
+        }
+      }
+      session->peer_initial_window = value;
+      for(stream = session->streams; stream != NULL; stream = stream->next)
+      {
+        stream->send_window += delta;
+      }
+      pthread_cond_broadcast(&session->cond);
+      pthread_mutex_unlock(&session->lock);
+    }
+  }
+  return 0;
+}
+
+int H2OnSettings(H2Session* session, int flags, uint32_t stream_id,
+    const unsigned char* payload, size_t len)
+{
+  if(stream_id != 0)
+  {
+    return H2_PROTOCOL_ERROR;
+  }
+  if(flags & H2_FLAG_ACK)
+  {
+    return len == 0 ? 0 : H2_FRAME_SIZE_ERROR;
+  }
+  int err = H2ApplySettings(session, payload, len);
+  if(err != 0)
+  {
+    return err;
+  }
+  H2WriteFrame(session, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+  return 0;
+}
+
+int H2OnWindowUpdate(H2Session* session, uint32_t stream_id,
+    const unsigned char* payload, size_t len)
+{
+  if(len != 4)
+  {
+    return H2_FRAME_SIZE_ERROR;
+  }
+  uint32_t increment = H2GetUint32(payload) & 0x7fffffff;
+  if(increment == 0 || stream_id > session->last_stream_id)
+  {
+    return H2_PROTOCOL_ERROR;
+  }
+  // 窗口最大只能是 2^31-1, 超过了在连接上是连接错误，在流上是流错误
+  int err = 0;
+  int rst = 0;
+  pthread_mutex_lock(&session->lock);
+  if(stream_id == 0)
+  {
+    if(session->send_window + increment > 0x7fffffff)
+    {
+      err = H2_FLOW_CONTROL_ERROR;
+    }
+    else
+    {
+      session->send_window += increment;
+    }
+  }
+  else
+  {
+    H2Stream* stream = H2FindStream(session, stream_id);
+    if(stream != NULL && !stream->reset)
+    {
+      if(stream->send_window + increment > 0x7fffffff)
+      {
+        stream->reset = 1;
+        rst = 1;
+      }
+      else
+      {
+        stream->send_window += increment;
+      }
+    }
+  }
+  pthread_cond_broadcast(&session->cond);
+  pthread_mutex_unlock(&session->lock);
+  if(rst)
+  {
+    H2SendRstStream(session, stream_id, H2_FLOW_CONTROL_ERROR);
+  }
+  return err;
+}
+
+int H2OnRstStream(H2Session* session, uint32_t stream_id, size_t len)
+{
+  if(stream_id == 0 || stream_id > session->last_stream_id)
+  {
+    // 不能重置连接本身，也不能重置还没有打开过的流
+    return H2_PROTOCOL_ERROR;
+  }
+  if(len != 4)
+  {
+    return H2_FRAME_SIZE_ERROR;
+  }
+  pthread_mutex_lock(&session->lock);
+  H2Stream* stream = H2FindStream(session, stream_id);
+  if(stream != NULL)
+  {
+    stream->reset = 1;
+    pthread_cond_broadcast(&session->cond);
+  }
+  pthread_mutex_unlock(&session->lock);
+  return 0;
+}
+
+int H2OnPing(H2Session* session, int flags, uint32_t stream_id,
+    const unsigned char* payload, size_t len)
+{
+  if(stream_id != 0)
+  {
+    return H2_PROTOCOL_ERROR;
+  }
+  if(len != 8)
+  {
+    return H2_FRAME_SIZE_ERROR;
+  }
+  if((flags & H2_FLAG_ACK) == 0)
+  {
+    H2WriteFrame(session, H2_PING, H2_FLAG_ACK, 0, payload, len);
+  }
+  return 0;
+}
+
+int H2OnGoaway(H2Session* session, uint32_t stream_id, size_t len)
+{
+  if(stream_id != 0)
+  {
+    return H2_PROTOCOL_ERROR;
+  }
+  if(len < 8)
+  {
+    return H2_FRAME_SIZE_ERROR;
+  }
+  // 已经在处理的流继续处理完，只是不再接受新的流
+  session->goaway = 1;
+  return 0;
+}
+
+// 优先级信息直接忽略，只检查帧的格式
+int H2OnPriority(uint32_t stream_id, size_t len)
+{
+  if(stream_id == 0)
+  {
+    return H2_PROTOCOL_ERROR;
+  }
+  if(len != 5)
+  {
+    return H2_FRAME_SIZE_ERROR;
+  }
+  return 0;
+}
+
+// 读线程的主循环，返回需要在 GOAWAY 中带上的错误码，连接断开返回 -1
+int H2ReadLoop(H2Session* session)
+{
+  unsigned char header[9];
+  unsigned char payload[H2_FRAME_SIZE];
+  while(1)
+  {
+    if(H2ReadAll(session->conn, header, sizeof(header)) < 0)
+    {
+      return -1;
+    }
+    size_t len = (header[0] << 16) | (header[1] << 8) | header[2];
+    int type = header[3];
+    int flags = header[4];
+    uint32_t stream_id = H2GetUint32(header + 5) & 0x7fffffff;
+    if(len > H2_FRAME_SIZE)
+    {
+      return H2_FRAME_SIZE_ERROR;
+    }
+    if(H2ReadAll(session->conn, payload, len) < 0)
+    {
+      return -1;
+    }
+    // 头部块的 HEADERS 和 CONTINUATION 之间不能插入其它帧
+    if(session->header_stream_id != 0 && type != H2_CONTINUATION)
+    {
+      return H2_PROTOCOL_ERROR;
+    }
+    int err = 0;
+    switch(type)
+    {
+      case H2_DATA:
+        err = H2OnData(session, flags, stream_id, payload, len);
+        break;
+      case H2_HEADERS:
+        err = H2OnHeaders(session, flags, stream_id, payload, len);
+        break;
+      case H2_CONTINUATION:
+        err = H2OnContinuation(session, flags, stream_id, payload, len);
+        break;
+      case H2_SETTINGS:
+        err = H2OnSettings(session, flags, stream_id, payload, len);
+        break;
+      case H2_WINDOW_UPDATE:
+        err = H2OnWindowUpdate(session, stream_id, payload, len);
+        break;
+      case H2_RST_STREAM:
+        err = H2OnRstStream(session, stream_id, len);
+        break;
+      case H2_PING:
+        err = H2OnPing(session, flags, stream_id, payload, len);
+        break;
+      case H2_GOAWAY:
+        err = H2OnGoaway(session, stream_id, len);
+        break;
+      case H2_PRIORITY:
+        err = H2OnPriority(stream_id, len);
+        break;
+      case H2_PUSH_PROMISE:
+        // 客户端不能推送
+        err = H2_PROTOCOL_ERROR;
+        break;
+      default:
+        // 未知类型的帧直接忽略
+        break;
+    }
+    if(err != 0)
+    {
+      return err;
+    }
+  }
+}
+
+// base64url 解码，HTTP2-Settings 头用的就是这种编码
+ssize_t Base64UrlDecode(const char* in, unsigned char* out, size_t out_size)
+{
+  uint32_t bits = 0;
+  int bit_count = 0;
+  size_t len = 0;
+  for(; *in != '\0' && *in != '='; ++in)
+  {
+    int v = 0;
+    if(*in >= 'A' && *in <= 'Z') v = *in - 'A';
+    else if(*in >= 'a' && *in <= 'z') v = *in - 'a' + 26;
+    else if(*in >= '0' && *in <= '9') v = *in - '0' + 52;
+    else if(*in == '-' || *in == '+') v = 62;
+    else if(*in == '_' || *in == '/') v = 63;
+    else return -1;
+    bits = (bits << 6) | v;
+    bit_count += 6;
+    if(bit_count >= 8)
+    {
+      bit_count -= 8;
+      if(len >= out_size)
+      {
+        return -1;
+      }
+      out[len++] = (bits >> bit_count) & 0xff;
+    }
+  }
+  return len;
+}
+
+// 在 conn 上运行 HTTP/2, 直到连接断开。
+// upgrade_req 不为 NULL 表示是从 HTTP/1.1 通过 Upgrade: h2c 升级过来的，
+// 这个请求就作为 1 号流来处理。preface 是还没有读到的那部分连接前言。
+void H2Serve(HttpConn* conn, const HttpRequest* upgrade_req, const char* preface)
+{
+  H2Session* session = calloc(1, sizeof(H2Session));
+  session->conn = conn;
+  pthread_mutex_init(&session->ssl_lock, NULL);
+  pthread_mutex_init(&session->write_lock, NULL);
+  pthread_mutex_init(&session->lock, NULL);
+  pthread_cond_init(&session->cond, NULL);
+  session->send_window = H2_WINDOW_SIZE;
+  session->recv_window = H2_CONN_WINDOW_SIZE;
+  session->peer_initial_window = H2_WINDOW_SIZE;
+  session->hpack.max_size = H2_HEADER_TABLE_SIZE;
+  // 帧都是一次写完整的，关掉 Nagle 算法，否则窗口较小时每个小帧
+  // 都要等对端的延迟 ACK.
+  int opt = 1;
+  setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+  int flags = fcntl(conn->sock, F_GETFL);
+  if(conn->ssl != NULL)
+  {
+    conn->ssl_lock = &session->ssl_lock;
+    fcntl(conn->sock, F_SETFL, flags | O_NONBLOCK);
+  }
+
+  // 服务器的连接前言就是一个 SETTINGS 帧，其它参数都用默认值
+  unsigned char settings[6] = {0};
+  settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+  H2PutUint32(settings + 2, H2_MAX_STREAMS);
+  int err = -1;
+  // 连接窗口只能通过 WINDOW_UPDATE 放大，让每个流都能用满自己的窗口
+  if(H2WriteFrame(session, H2_SETTINGS, 0, 0, settings, sizeof(settings)) < 0
+      || H2SendWindowUpdate(session, 0, H2_CONN_WINDOW_SIZE - H2_WINDOW_SIZE) < 0)
+  {
+    goto END;
+  }
+  if(upgrade_req != NULL)
+  {
+    // 升级请求中 HTTP2-Settings 里的参数相当于客户端的第一个 SETTINGS 帧,
+    // 101 响应就是对它的确认，不需要再回 ACK.
+    unsigned char peer_settings[sizeof(upgrade_req->http2_settings)];
+    ssize_t len = Base64UrlDecode(upgrade_req->http2_settings, peer_settings,
+        sizeof(peer_settings));
+    if(len < 0 || H2ApplySettings(session, peer_settings, len) != 0)
+    {
+      goto END;
+    }
+    H2Stream* stream = H2NewStream(session, 1);
+    snprintf(stream->method, sizeof(stream->method), "%s", upgrade_req->method);
+    snprintf(stream->path, sizeof(stream->path), "%s%s%s", upgrade_req->url,
+        upgrade_req->query_string != NULL ? "?" : "",
+        upgrade_req->query_string != NULL ? upgrade_req->query_string : "");
+    stream->content_length = 0;
+    stream->body_done = 1;
+    session->last_stream_id = 1;
+    if(H2StartStream(session, stream) < 0)
+    {
+      free(stream);
+      goto END;
+    }
+  }
+  char buf[sizeof(H2_PREFACE)];
+  if(H2ReadAll(conn, buf, strlen(preface)) < 0 || memcmp(buf, preface, strlen(preface)) != 0)
+  {
+    printf("HTTP/2 preface error!\n");
+    goto END;
+  }
+  err = H2ReadLoop(session);
+
+END:
+  if(err > 0)
+  {
+    H2SendGoaway(session, err);
+  }
+  // 读线程退出后，还在跑的流也没法再收到 WINDOW_UPDATE 了，
+  // 直接关掉 socket 让它们尽快失败返回，等它们全部退出后再释放连接。
+  shutdown(conn->sock, SHUT_RDWR);
+  pthread_mutex_lock(&session->lock);
+  session->closed = 1;
+  pthread_cond_broadcast(&session->cond);
+  while(session->stream_count > 0)
+  {
+    pthread_cond_wait(&session->cond, &session->lock);
+  }
+  pthread_mutex_unlock(&session->lock);
+
+  conn->ssl_lock = NULL;
+  fcntl(conn->sock, F_SETFL, flags);
+  HpackEvict(&session->hpack, 0);
+  free(session->header_block);
+  pthread_mutex_destroy(&session->ssl_lock);
+  pthread_mutex_destroy(&session->write_lock);
+  pthread_mutex_destroy(&session->lock);
+  pthread_cond_destroy(&session->cond);
+  free(session);
+}
+
+// 这个函数才是真正的完成一次请求的完整过程
+void HandlerRequest(HttpConn* conn)
+{
+  // 1.读取请求并解析
+  //   a) 从 socket 中读出HTTP请求的首行。
+  int err_code = 200;
+  HttpRequest req;
+  memset(&req, 0, sizeof(req));
+  if(ReadLine(conn, req.first_line, sizeof(req.first_line)-1) < 0)
+  {
+    printf("ReadLine first_line failed!\n");
+    //对于错误的处理情况，统一返回404
+    err_code = 404;
+    goto END;
+    // 构造 404 响应的代码
+  }
+  //   HTTP/2 的连接前言 "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" 的第一行也能被
+  //   ReadLine 读出来。客户端事先知道服务器支持 HTTP/2(h2c prior knowledge),
+  //   或者 TLS 握手时通过 ALPN 协商出了 h2, 读到的首行就是它。
+  if(strcmp(req.first_line, "PRI * HTTP/2.0\n") == 0)
+  {
+    H2Serve(conn, NULL, "\r\nSM\r\n\r\n");
+    goto END;
+  }
+  //   b) 解析首行，获取到方法，url, 版本号(不用)。
+  if(ParseFirstLine(req.first_line, &req.method, &req.url) < 0)
+  {                                 // req.method 和 req.url 都是输出型参数
+    printf("ParseFirstLine failed! first_line=%s\n", req.first_line);
+    err_code = 404;
+    goto END;
+    // 构造 404 响应的代码
+  }
+  //   c) 对 url 再进行解析，解析出其中的 url_path, query_string
+  if(ParseQueryString(req.url, &req.url_path, &req.query_string) < 0)
+  {
+    printf("ParseQueryString failed! url=%s\n", req.url);
+    err_code = 404;
+    goto END;
+    // 构造 404 响应的代码
+  }
+  //   d) 读取并解析 header 部分(此处为了简单，只保留 content_length，
+  //      其它的 header 内容就直接丢弃了)。
+  if(HandlerHeader(conn, &req) < 0)
+  {
+    printf("HandlerHeader failed!\n");
+    err_code = 404;
+    goto END; 
+    // 构造 404 响应的代码
+  }
+  //   e) 客户端通过 Upgrade: h2c 请求把明文连接升级成 HTTP/2,
+  //      没有带 HTTP2-Settings 的请求不能升级，带 body 的请求也不升级，
+  //      都直接按 HTTP/1.1 处理。
+  if(req.upgrade_h2c && req.http2_settings[0] != '\0'
+      && conn->ssl == NULL && req.content_length == 0)
+  {
+    const char* switching = "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    ConnSend(conn, switching, strlen(switching));
+    H2Serve(conn, &req, H2_PREFACE);
+    goto END;
+  }
+  // 2.根据请求的详细情况执行静态页面逻辑还是动态页面逻辑
+  err_code=HandlerDispatch(conn, &req);
+END:
+  // 这次请求处理结束的收尾工作
+  if(err_code != 200)
+  {
+    Handler404(conn);
+  }
+
+  // 此处我们只考虑短链接。短连接的意思是每次客户端(浏览器)
+  // 给服务器发送请求之前，都是新建立一个 socket 进行连接。
+  // 对于短连接来说，如果响应写完了，就可以关闭 new_sock.
+  // 此处由于是服务器主动断开连接，也就进入 TIME_WAIT 状态。
+  // 由于服务器可能短时间内就处理了大量的连接，导致服务器上
+  // 出现了大量的 TIME_WAIT. 导致服务器没法处理新的连接。
+  // 所以需要设置 setsockopt REUSEADDR 来重用 TIME_WAIT 状态
+  // 的连接。
+  ConnClose(conn);
+  // 文件描述符关闭的前提是：该文件描述符不用了
+}
+
+void *ThreadEntry(void *arg)
+{
+  // 线程入口函数，负责这一次请求的完整过程。
+  HttpConn conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.sock = (int64_t)arg; 
+  if(g_ssl_ctx != NULL && TlsAccept(&conn) < 0)
+  {
+    printf("TlsAccept failed!\n");
+    ConnClose(&conn);
+    return NULL;
+  }
+  HandlerRequest(&conn);
+  return NULL;
+}
+
+void HttpServerStart(const char* ip, short port)
+{
+  // 1. 创建 tcp socket 
+  int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+  if(listen_sock < 0)
+  {
+    perror("socket");
+    return;
+  }
+
+  // 设置 REUSERADDR,处理后面短连接主动关闭 socket 的问题。
+  int opt = 1; // 启动 setsockopt 这个功能
+  setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+  // 2. 绑定端口号
+  sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr(ip);
+  addr.sin_port = htons(port);
+  int ret = bind(listen_sock, (sockaddr*)&addr, sizeof(addr));
+  if(ret < 0)
+  {
+    perror("bind");
     return;
   }
   // 3. 监听 socket
@@ -645,13 +2568,26 @@ void HttpServerStart(const char* ip, short port)
 
 int main(int argc, char* argv[])
 {
-  if(argc != 3)
+  if(argc != 3 && argc != 5)
   {
-    printf("Usage ./http_server [ip] [port]\n");
+    printf("Usage ./http_server [ip] [port] [cert.pem key.pem]\n");
     return 1;
   }
+  if(argc == 5)
+  {
+    // 带上证书和私钥时，服务器只接受 TLS 连接
+    g_ssl_ctx = TlsInit(argv[3], argv[4]);
+    if(g_ssl_ctx == NULL)
+    {
+      printf("TlsInit failed!\n");
+      return 1;
+    }
+  }
 
   signal(SIGCHLD, SIG_IGN); // 线程共享信号处理函数
+  // 对端提前断开时，向 socket 写数据会触发 SIGPIPE 导致整个进程退出，
+  // 尤其是 TLS 关闭连接时还要发送 close_notify, 所以忽略该信号。
+  signal(SIGPIPE, SIG_IGN);
 
   HttpServerStart(argv[1], atoi(argv[2]));
   return 0;